@@ -31,6 +31,14 @@
 #include <Urho3D/Math/RandomEngine.h>
 #include <Urho3D/Graphics/AnimatedModel.h>
 #include <Urho3D/Graphics/AnimationController.h>
+#include <Urho3D/Graphics/Graphics.h>
+#include <Urho3D/Engine/Engine.h>
+#include <Urho3D/Core/ProcessUtils.h>
+#include <Urho3D/Core/StringUtils.h>
+#include <Urho3D/Core/Timer.h>
+#include <Urho3D/IO/File.h>
+#include <Urho3D/IO/FileSystem.h>
+#include <algorithm>
 #include <cmath>
 // This is probably always OK.
 using namespace Urho3D;
@@ -160,6 +168,7 @@ class AtmosphereSettings
 		time_=0.f;
 	}
 	void SetInterval(float i){interval_=i;}
+	void SetSeed(unsigned int seed){random_=RandomEngine(seed);}
 	
 	SkyPreset Update(float dt)
 	{
@@ -204,6 +213,210 @@ class AtmosphereSettings
 	}
 };
 
+// One sample of a recorded flythrough: camera placement, time of day, cloud time and sky parameters.
+struct FlythroughKey
+{
+	float time_{0};
+	Vector3 position_{0,0,0};
+	float yaw_{0}, pitch_{0};
+	float timeofday_{0};
+	float cloudtime_{0};
+	SkyPreset preset_;
+
+	FlythroughKey Lerp(const FlythroughKey &rhs, float t)
+	{
+		FlythroughKey k;
+		k.time_=time_ + t * (rhs.time_ - time_);
+		k.position_=position_.Lerp(rhs.position_, t);
+		k.yaw_=yaw_ + t * (rhs.yaw_ - yaw_);
+		k.pitch_=pitch_ + t * (rhs.pitch_ - pitch_);
+
+		// Time of day wraps at 24, take the shorter way around so small backward steps stay small
+		float tod=rhs.timeofday_;
+		if(tod - timeofday_ > 12.f) tod -= 24.f;
+		else if(timeofday_ - tod > 12.f) tod += 24.f;
+		k.timeofday_=timeofday_ + t * (tod - timeofday_);
+		if(k.timeofday_ >= 24.f) k.timeofday_ -= 24.f;
+		else if(k.timeofday_ < 0.f) k.timeofday_ += 24.f;
+
+		k.cloudtime_=cloudtime_ + t * (rhs.cloudtime_ - cloudtime_);
+		k.preset_=preset_.Lerp(rhs.preset_, t);
+		return k;
+	}
+};
+
+// Flythrough track file. Plain text, one entry per line, '#' starts a comment:
+//   timestep <seconds>
+//   seed <unsigned>
+//   key <time> <x> <y> <z> <yaw> <pitch> <timeofday> <cloudtime> <Br> <Bm> <g> <cirrus> <cumulus> <cumulusbrightness>
+// Keys are linearly interpolated. Camera height is re-snapped to the ground on playback, so hand written tracks may use y=0.
+class FlythroughTrack
+{
+	public:
+	FlythroughTrack(){}
+
+	// Filename is tried as a path first, then as a resource name (e.g. Flythroughs/Benchmark.txt)
+	bool Load(Context *context, const ea::string &filename)
+	{
+		SharedPtr<File> file;
+		if(context->GetSubsystem<FileSystem>()->FileExists(filename)) file=new File(context, filename, FILE_READ);
+		else file=context->GetSubsystem<ResourceCache>()->GetFile(filename, false);
+		if(!file || !file->IsOpen()) return false;
+
+		keys_.clear();
+		lastkey_=0;
+		while(!file->IsEof())
+		{
+			ea::string line=file->ReadLine();
+			ea::vector<ea::string> fields=line.split(' ');
+			if(fields.empty() || fields[0][0]=='#') continue;
+
+			const ea::string &tag=fields[0];
+			if(tag=="timestep" && fields.size()==2) timestep_=ToFloat(fields[1]);
+			else if(tag=="seed" && fields.size()==2) seed_=ToUInt(fields[1]);
+			else if(tag=="key" && fields.size()==15)
+			{
+				FlythroughKey k;
+				SkyPreset &p=k.preset_;
+				k.time_=ToFloat(fields[1]);
+				k.position_=Vector3(ToFloat(fields[2]), ToFloat(fields[3]), ToFloat(fields[4]));
+				k.yaw_=ToFloat(fields[5]);
+				k.pitch_=ToFloat(fields[6]);
+				k.timeofday_=ToFloat(fields[7]);
+				k.cloudtime_=ToFloat(fields[8]);
+				p.Br_=ToFloat(fields[9]);
+				p.Bm_=ToFloat(fields[10]);
+				p.g_=ToFloat(fields[11]);
+				p.cirrus_=ToFloat(fields[12]);
+				p.cumulus_=ToFloat(fields[13]);
+				p.cumulusbrightness_=ToFloat(fields[14]);
+				keys_.push_back(k);
+			}
+			else URHO3D_LOGWARNINGF("Malformed flythrough entry in %s: %s", filename.c_str(), line.c_str());
+		}
+
+		std::stable_sort(keys_.begin(), keys_.end(), [](const FlythroughKey &a, const FlythroughKey &b){return a.time_ < b.time_;});
+		if(timestep_ <= 0.f) timestep_=1.f/60.f;
+		return !keys_.empty();
+	}
+
+	bool Save(Context *context, const ea::string &filename)
+	{
+		File file(context, filename, FILE_WRITE);
+		if(!file.IsOpen()) return false;
+
+		file.WriteLine("# key time x y z yaw pitch timeofday cloudtime Br Bm g cirrus cumulus cumulusbrightness");
+		file.WriteLine(ToString("timestep %.9g", timestep_));
+		file.WriteLine(ToString("seed %u", seed_));
+		for(const FlythroughKey &k : keys_)
+		{
+			const SkyPreset &p=k.preset_;
+			file.WriteLine(ToString("key %.9g %.9g %.9g %.9g %.9g %.9g %.9g %.9g %.9g %.9g %.9g %.9g %.9g %.9g", k.time_, k.position_.x_, k.position_.y_, k.position_.z_,
+				k.yaw_, k.pitch_, k.timeofday_, k.cloudtime_, p.Br_, p.Bm_, p.g_, p.cirrus_, p.cumulus_, p.cumulusbrightness_));
+		}
+		return true;
+	}
+
+	void AddKey(const FlythroughKey &k){keys_.push_back(k);}
+
+	// Playback time only moves forward, so the search resumes from the last bracketing key
+	FlythroughKey Sample(float t)
+	{
+		if(keys_.empty()) return FlythroughKey();
+		if(t <= keys_.front().time_) return keys_.front();
+
+		if(lastkey_ >= keys_.size() || keys_[lastkey_].time_ > t) lastkey_=0;
+		while(lastkey_+1 < keys_.size() && keys_[lastkey_+1].time_ < t) ++lastkey_;
+		if(lastkey_+1 >= keys_.size()) return keys_.back();
+
+		FlythroughKey &a=keys_[lastkey_], &b=keys_[lastkey_+1];
+		float span=b.time_ - a.time_;
+		return a.Lerp(b, span > 0.f ? (t - a.time_) / span : 1.f);
+	}
+
+	float GetLength() const {return keys_.empty() ? 0.f : keys_.back().time_;}
+	unsigned int GetNumKeys() const {return (unsigned int)keys_.size();}
+
+	float timestep_{1.f/60.f};
+	unsigned int seed_{1};
+
+	protected:
+	ea::vector<FlythroughKey> keys_;
+	unsigned int lastkey_{0};
+};
+
+struct BenchmarkFrame
+{
+	unsigned int frame_{0};
+	float time_{0};
+	float scenems_{0}, framems_{0};
+	unsigned int drawcalls_{0}, geometries_{0}, instances_{0}, triangles_{0};
+};
+
+// Collects per frame statistics during playback and writes them out as CSV
+class BenchmarkLog
+{
+	public:
+	BenchmarkLog(){}
+
+	void AddFrame(const BenchmarkFrame &f){frames_.push_back(f);}
+	unsigned int GetNumFrames() const {return (unsigned int)frames_.size();}
+
+	bool WriteCSV(Context *context, const ea::string &filename)
+	{
+		File file(context, filename, FILE_WRITE);
+		if(!file.IsOpen()) return false;
+
+		file.WriteLine("frame,time,scene_ms,frame_ms,drawcalls,geometries,instances,triangles");
+		for(const BenchmarkFrame &f : frames_)
+		{
+			file.WriteLine(ToString("%u,%.4f,%.4f,%.4f,%u,%u,%u,%u", f.frame_, f.time_, f.scenems_, f.framems_, f.drawcalls_, f.geometries_, f.instances_, f.triangles_));
+		}
+		return true;
+	}
+
+	void LogSummary()
+	{
+		ea::vector<float> scene, frame;
+		double drawcalls=0, geometries=0, instances=0, triangles=0;
+		for(const BenchmarkFrame &f : frames_)
+		{
+			scene.push_back(f.scenems_);
+			frame.push_back(f.framems_);
+			drawcalls += f.drawcalls_;
+			geometries += f.geometries_;
+			instances += f.instances_;
+			triangles += f.triangles_;
+		}
+		double n=(double)frames_.size();
+
+		URHO3D_LOGINFOF("Benchmark: %u frames", (unsigned int)frames_.size());
+		LogPercentiles("scene_ms", scene);
+		LogPercentiles("frame_ms", frame);
+		URHO3D_LOGINFOF("Benchmark: mean drawcalls %.1f geometries %.1f instances %.1f triangles %.1f", drawcalls/n, geometries/n, instances/n, triangles/n);
+	}
+
+	protected:
+	ea::vector<BenchmarkFrame> frames_;
+
+	static float Percentile(const ea::vector<float> &sorted, float pct)
+	{
+		// Nearest rank
+		unsigned int rank=(unsigned int)std::ceil(pct / 100.f * (float)sorted.size());
+		return sorted[std::min((unsigned int)sorted.size()-1, rank > 0 ? rank-1 : 0)];
+	}
+
+	static void LogPercentiles(const char *name, ea::vector<float> &values)
+	{
+		std::sort(values.begin(), values.end());
+		double sum=0;
+		for(float v : values) sum += v;
+
+		URHO3D_LOGINFOF("Benchmark: %s min %.3f mean %.3f p50 %.3f p90 %.3f p95 %.3f p99 %.3f max %.3f", name, values.front(), sum/(double)values.size(),
+			Percentile(values, 50.f), Percentile(values, 90.f), Percentile(values, 95.f), Percentile(values, 99.f), values.back());
+	}
+};
+
 class AwesomeGameApplication : public Application
 {
     // This macro defines some methods that every `Urho3D::Object` descendant should have.
@@ -225,6 +438,36 @@ public:
         engineParameters_[EP_RESOURCE_PREFIX_PATHS] = ".;..";
 		engineParameters_[EP_WINDOW_MAXIMIZE] = true;
 		engineParameters_[EP_WINDOW_RESIZABLE]=true;
+
+		// Flythrough options:
+		//   -record <track>      record camera, time of day and sky parameters to a track file on exit
+		//   -benchmark <track>   play a track back with a fixed timestep, write per frame stats and exit
+		//   -benchmarkcsv <csv>  where to write the per frame stats (default benchmark.csv)
+		//   -timestep <seconds>  override the track timestep
+		//   -seed <unsigned>     override the random seed
+		//   -warmup <frames>     frames rendered at the start of the track before stats are collected
+		const ea::vector<ea::string> &args=GetArguments();
+		for(unsigned int i=0; i+1<args.size(); ++i)
+		{
+			if(args[i]=="-record") recordfile_=args[++i];
+			else if(args[i]=="-benchmark") playbackfile_=args[++i];
+			else if(args[i]=="-benchmarkcsv") csvfile_=args[++i];
+			else if(args[i]=="-timestep") fixedtimestep_=ToFloat(args[++i]);
+			else if(args[i]=="-warmup") warmup_=ToUInt(args[++i]);
+			else if(args[i]=="-seed")
+			{
+				seed_=ToUInt(args[++i]);
+				seedset_=true;
+			}
+		}
+
+		if(!playbackfile_.empty())
+		{
+			// Keep runs comparable: fixed window size, no vsync or frame limiting
+			engineParameters_[EP_WINDOW_MAXIMIZE] = false;
+			engineParameters_[EP_WINDOW_RESIZABLE] = false;
+			engineParameters_[EP_VSYNC] = false;
+		}
     }
 
     void Start() override
@@ -233,6 +476,44 @@ public:
         // At this point engine is initialized, but first frame was not rendered yet. Further setup should be done here. To make sample a little bit user friendly show mouse cursor here.
         GetSubsystem<Input>()->SetMouseVisible(true);
 		
+		if(!playbackfile_.empty())
+		{
+			if(!track_.Load(context_, playbackfile_))
+			{
+				FailBenchmark("Could not load flythrough track " + playbackfile_);
+				return;
+			}
+			if(track_.GetLength() <= 0.f)
+			{
+				FailBenchmark("Flythrough track " + playbackfile_ + " has zero length");
+				return;
+			}
+			if(fixedtimestep_ > 0.f) track_.timestep_=fixedtimestep_;
+			if(!seedset_) seed_=track_.seed_;
+			seedset_=true;
+			playback_=true;
+
+			auto engine=GetSubsystem<Engine>();
+			engine->SetMaxFps(0);
+			engine->SetNextTimeStep(track_.timestep_);
+			URHO3D_LOGINFOF("Benchmark: playing %s, %u keys, %.2f seconds at timestep %.5f, seed %u", playbackfile_.c_str(), track_.GetNumKeys(), track_.GetLength(), track_.timestep_, seed_);
+		}
+		else if(!recordfile_.empty())
+		{
+			if(fixedtimestep_ > 0.f) track_.timestep_=fixedtimestep_;
+			// Always seed while recording so the seed written to the track is the one actually used
+			if(!seedset_) seed_=track_.seed_;
+			seedset_=true;
+			recording_=true;
+		}
+
+		if(seedset_)
+		{
+			SetRandomSeed(seed_);
+			atmosphere_.SetSeed(seed_);
+			track_.seed_=seed_;
+		}
+		
 		scene_=new Scene(context_);
 		scene_->CreateComponent<Octree>();
 		
@@ -338,6 +619,9 @@ public:
 			}
 		}
 		
+		// Gathered once, the foliage groups have tens of thousands of instance child nodes to walk
+		scene_->GetDerivedComponents<StaticModelGroup>(instancegroups_, true);
+		
 		Material *m=cache->GetResource<Material>("Materials/GrassTest.xml");
 		m->SetShaderParameter("HeightMapData", Variant(Vector4(terrain_->GetHeightMap()->GetWidth(), terrain_->GetHeightMap()->GetHeight(), terrain_->GetSpacing().x_, terrain_->GetSpacing().y_)));
 		m->SetShaderParameter("Radius", Variant(Vector2((float)radius*0.8f, (float)radius)));
@@ -367,7 +651,20 @@ public:
 		dynamic_cast<Slider *>(element_->GetChild("CumulusBrightnessSlider", true))->SetValue(33);
 		dynamic_cast<Slider *>(element_->GetChild("SunSlider", true))->SetValue(10);
 		
+		// Keep UI cost out of the measurements, the sliders are not used during playback anyway
+		if(playback_)
+		{
+			element_->SetVisible(false);
+			toggle_->SetVisible(false);
+		}
+		
 		SubscribeToEvent(StringHash("Update"), URHO3D_HANDLER(AwesomeGameApplication, HandleUpdate));
+		if(playback_)
+		{
+			SubscribeToEvent(StringHash("BeginFrame"), URHO3D_HANDLER(AwesomeGameApplication, HandleBeginFrame));
+			SubscribeToEvent(StringHash("EndViewRender"), URHO3D_HANDLER(AwesomeGameApplication, HandleEndViewRender));
+			SubscribeToEvent(StringHash("EndFrame"), URHO3D_HANDLER(AwesomeGameApplication, HandleEndFrame));
+		}
 		SubscribeToEvent(toggle_, StringHash("Pressed"), URHO3D_HANDLER(AwesomeGameApplication, HandleToggle));
 		SubscribeToEvent(element_->GetChild("AddPresetButton", true), StringHash("Pressed"), URHO3D_HANDLER(AwesomeGameApplication, HandleAddPreset));
 	}
@@ -375,6 +672,11 @@ public:
     void Stop() override
     {
         // This step is executed when application is closing. No more frames will be rendered after this method is invoked.
+		if(recording_)
+		{
+			if(track_.Save(context_, recordfile_)) URHO3D_LOGINFOF("Recorded %u flythrough keys to %s", track_.GetNumKeys(), recordfile_.c_str());
+			else URHO3D_LOGERRORF("Could not write flythrough track %s", recordfile_.c_str());
+		}
     }
 	
 	float GetSliderValue(const ea::string &name, float rangelow, float rangehigh)
@@ -400,7 +702,14 @@ public:
 		auto cache=GetSubsystem<ResourceCache>();
 		float speedmul=0.1f;
 		SkyPreset p;
-		if(manual_)
+		FlythroughKey key;
+		if(playback_)
+		{
+			key=track_.Sample(tracktime_);
+			p=key.preset_;
+			timeofday_=key.timeofday_;
+		}
+		else if(manual_)
 		{
 			p.Br_=GetSliderValue("Br", 0.0001, 0.009);
 			p.Bm_=GetSliderValue("Bm", 0.0001, 0.009);
@@ -427,7 +736,8 @@ public:
 		skyboxmaterial_->SetShaderParameter("Cumulus", Variant(p.cumulus_));
 		skyboxmaterial_->SetShaderParameter("CumulusBrightness", Variant(p.cumulusbrightness_));
 		
-		time_ += timeStep*speedmul;
+		if(playback_) time_=key.cloudtime_;
+		else time_ += timeStep*speedmul;
 		skyboxmaterial_->SetShaderParameter("CloudTime", Variant(time_));
 		
 		terrainmaterial_->SetShaderParameter("TimeOfDay", Variant(timeofday_));
@@ -469,7 +779,30 @@ public:
 		m=cache->GetResource<Material>("Materials/FlowerTest.xml");
 		m->SetShaderParameter("ActualCameraPos", Variant(cameraNode_->GetWorldPosition()));
 		
-		MoveCamera(timeStep);
+		if(playback_) PlaceCamera(key);
+		else MoveCamera(timeStep);
+		
+		if(recording_)
+		{
+			FlythroughKey k;
+			k.time_=tracktime_;
+			k.position_=cameraNode_->GetPosition();
+			k.yaw_=yaw_;
+			k.pitch_=pitch_;
+			k.timeofday_=timeofday_;
+			k.cloudtime_=time_;
+			k.preset_=p;
+			track_.AddKey(k);
+			tracktime_ += timeStep;
+		}
+	}
+	void PlaceCamera(const FlythroughKey &key)
+	{
+		yaw_=key.yaw_;
+		pitch_=Clamp(key.pitch_, -90.0f, 90.0f);
+		cameraNode_->SetRotation(Quaternion(pitch_, yaw_, 0.0f));
+		cameraNode_->SetPosition(key.position_);
+		SnapCameraToGround();
 	}
 	void MoveCamera(float timeStep)
 	{
@@ -507,7 +840,10 @@ public:
 		if (input->GetKeyDown(KEY_D))
 			cameraNode_->Translate(Vector3::RIGHT * MOVE_SPEED * timeStep);
 		
-
+		SnapCameraToGround();
+	}
+	void SnapCameraToGround()
+	{
 		Octree *octree=scene_->GetComponent<Octree>();
 		float hitpos=0;
 		Drawable *hitdrawable=nullptr;
@@ -560,12 +896,98 @@ public:
 	
 	SharedPtr<UIElement> toggle_;
 	
+	// Flythrough recording and benchmark playback
+	ea::string recordfile_, playbackfile_, csvfile_{"benchmark.csv"};
+	bool recording_{false}, playback_{false}, seedset_{false};
+	unsigned int seed_{0};
+	float fixedtimestep_{0.f};
+	unsigned int warmup_{0};
+	FlythroughTrack track_;
+	float tracktime_{0.f};
+	unsigned int frame_{0};
+	BenchmarkLog benchmark_;
+	HiresTimer frametimer_;
+	ea::vector<StaticModelGroup *> instancegroups_;
+	float scenems_{0.f};
+	
 	void HandleUpdate(StringHash eventType, VariantMap &eventData)
 	{
 		float timeStep=eventData["TimeStep"].GetFloat();
 		Update(timeStep);
 	}
 	
+	void HandleBeginFrame(StringHash eventType, VariantMap &eventData)
+	{
+		frametimer_.Reset();
+	}
+	
+	void HandleEndViewRender(StringHash eventType, VariantMap &eventData)
+	{
+		// Wall clock from frame start to the end of the scene view (there is only one), so update and
+		// scene rendering including shadow maps, but not UI or present
+		scenems_=(float)frametimer_.GetUSec(false) / 1000.f;
+	}
+	
+	void HandleEndFrame(StringHash eventType, VariantMap &eventData)
+	{
+		if(!playback_) return;
+		
+		if(frame_ >= warmup_)
+		{
+			auto graphics=GetSubsystem<Graphics>();
+			BenchmarkFrame f;
+			f.frame_=frame_;
+			f.time_=tracktime_;
+			f.scenems_=scenems_;
+			f.framems_=(float)frametimer_.GetUSec(false) / 1000.f;
+			f.drawcalls_=graphics->GetNumBatches();
+			f.geometries_=GetSubsystem<Renderer>()->GetNumGeometries();
+			// A model group is a single drawable, count the instances it submits when it is in view
+			for(StaticModelGroup *g : instancegroups_)
+			{
+				if(g->IsInView()) f.instances_ += g->GetNumInstanceNodes();
+			}
+			f.triangles_=graphics->GetNumPrimitives();
+			benchmark_.AddFrame(f);
+			tracktime_ += track_.timestep_;
+		}
+		// Warmup frames hold the track at its start
+		++frame_;
+		
+		if(tracktime_ > track_.GetLength())
+		{
+			FinishBenchmark();
+			return;
+		}
+		GetSubsystem<Engine>()->SetNextTimeStep(track_.timestep_);
+	}
+	
+	void FinishBenchmark()
+	{
+		playback_=false;
+		if(benchmark_.GetNumFrames()==0)
+		{
+			FailBenchmark(ToString("Benchmark collected no frames, track is %.2f seconds with %u warmup frames", track_.GetLength(), warmup_));
+			return;
+		}
+		if(!benchmark_.WriteCSV(context_, csvfile_))
+		{
+			FailBenchmark("Could not write benchmark stats " + csvfile_);
+			return;
+		}
+		URHO3D_LOGINFOF("Benchmark: wrote per frame stats to %s", csvfile_.c_str());
+		benchmark_.LogSummary();
+		GetSubsystem<Engine>()->Exit();
+	}
+	
+	// Not ErrorExit, its message box would block an unattended run forever
+	void FailBenchmark(const ea::string &message)
+	{
+		URHO3D_LOGERROR(message);
+		exitCode_=EXIT_FAILURE;
+		engine_->Exit();
+	}
+	
 	void HandleToggle(StringHash eventType, VariantMap &eventData)
 	{
 		manual_= !manual_;